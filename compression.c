@@ -0,0 +1,185 @@
+#include "compression.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <memory.h>
+
+#define MIN_MATCH 4
+#define HASH_LOG 12
+#define MAX_OFFSET 0xFFFF
+
+static uint32_t read32(const uint8_t* ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Lengths that don't fit into a token nibble are continued with 255-terminated bytes
+static bool writeLength(uint8_t** dest, const uint8_t* destEnd, size_t length)
+{
+    while (length >= 255)
+    {
+        if (*dest == destEnd)
+        {
+            return false;
+        }
+        *(*dest)++ = 255;
+        length -= 255;
+    }
+    if (*dest == destEnd)
+    {
+        return false;
+    }
+    *(*dest)++ = (uint8_t) length;
+    return true;
+}
+
+static bool readLength(const uint8_t** src, const uint8_t* srcEnd, size_t* length)
+{
+    uint8_t byte;
+    do
+    {
+        if (*src == srcEnd)
+        {
+            return false;
+        }
+        byte = *(*src)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool writeSequence(uint8_t** dest, const uint8_t* destEnd, const uint8_t* literals, size_t literalsSize,
+                          size_t offset, size_t matchSize)
+{
+    if (*dest == destEnd)
+    {
+        return false;
+    }
+    uint8_t* token = (*dest)++;
+    *token = (uint8_t) ((literalsSize < 15 ? literalsSize : 15) << 4);
+    if (literalsSize >= 15 && !writeLength(dest, destEnd, literalsSize - 15))
+    {
+        return false;
+    }
+    if ((size_t) (destEnd - *dest) < literalsSize)
+    {
+        return false;
+    }
+    memcpy(*dest, literals, literalsSize);
+    *dest += literalsSize;
+    // The last sequence has literals only
+    if (matchSize == 0)
+    {
+        return true;
+    }
+
+    if (destEnd - *dest < 2)
+    {
+        return false;
+    }
+    *(*dest)++ = (uint8_t) (offset & 0xFF);
+    *(*dest)++ = (uint8_t) (offset >> 8);
+    matchSize -= MIN_MATCH;
+    *token |= (uint8_t) (matchSize < 15 ? matchSize : 15);
+    return matchSize < 15 || writeLength(dest, destEnd, matchSize - 15);
+}
+
+size_t compressBuffer(const uint8_t* src, size_t srcSize, uint8_t* dest, size_t destCapacity)
+{
+    // Positions are stored shifted by one, so zero means an empty slot
+    uint16_t table[1 << HASH_LOG];
+    assert(srcSize <= UINT16_MAX);
+    memset(table, 0, sizeof(table));
+
+    uint8_t* op = dest;
+    const uint8_t* destEnd = dest + destCapacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= srcSize)
+    {
+        uint32_t hash = hash32(read32(src + pos));
+        size_t candidate = table[hash];
+        table[hash] = (uint16_t) (pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET
+            || read32(src + candidate - 1) != read32(src + pos))
+        {
+            ++pos;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t matchSize = MIN_MATCH;
+        while (pos + matchSize < srcSize && src[match + matchSize] == src[pos + matchSize])
+        {
+            ++matchSize;
+        }
+        if (!writeSequence(&op, destEnd, src + anchor, pos - anchor, pos - match, matchSize))
+        {
+            return 0;
+        }
+        pos += matchSize;
+        anchor = pos;
+    }
+    if (!writeSequence(&op, destEnd, src + anchor, srcSize - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return (size_t) (op - dest);
+}
+
+size_t decompressBuffer(const uint8_t* src, size_t srcSize, uint8_t* dest, size_t destCapacity)
+{
+    const uint8_t* ip = src;
+    const uint8_t* srcEnd = src + srcSize;
+    size_t size = 0;
+    while (ip < srcEnd)
+    {
+        uint8_t token = *ip++;
+        size_t literalsSize = token >> 4;
+        if (literalsSize == 15 && !readLength(&ip, srcEnd, &literalsSize))
+        {
+            return 0;
+        }
+        if ((size_t) (srcEnd - ip) < literalsSize || destCapacity - size < literalsSize)
+        {
+            return 0;
+        }
+        memcpy(dest + size, ip, literalsSize);
+        ip += literalsSize;
+        size += literalsSize;
+        if (ip == srcEnd)
+        {
+            break;
+        }
+
+        if (srcEnd - ip < 2)
+        {
+            return 0;
+        }
+        size_t offset = ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+        size_t matchSize = token & 0xF;
+        if (matchSize == 15 && !readLength(&ip, srcEnd, &matchSize))
+        {
+            return 0;
+        }
+        matchSize += MIN_MATCH;
+        if (offset == 0 || offset > size || destCapacity - size < matchSize)
+        {
+            return 0;
+        }
+        // Byte by byte, since the match may overlap with the bytes being written
+        for (size_t i = 0; i < matchSize; ++i, ++size)
+        {
+            dest[size] = dest[size - offset];
+        }
+    }
+    return size;
+}
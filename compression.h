@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ4-style block codec used for compressed file clusters.
+// Returns the number of bytes written to dest, or 0 if the result does not fit into destCapacity.
+size_t compressBuffer(const uint8_t* src, size_t srcSize, uint8_t* dest, size_t destCapacity);
+
+// Returns the number of bytes written to dest, or 0 if the input is malformed or does not fit.
+size_t decompressBuffer(const uint8_t* src, size_t srcSize, uint8_t* dest, size_t destCapacity);
@@ -1,5 +1,6 @@
 #include "file_storage.h"
 
+#include "layout.h"
 #include "structs.h"
 #include <stdio.h>
 #include <assert.h>
@@ -8,9 +9,6 @@
 #include <signal.h>
 #include <stdbool.h>
 
-#define BLOCK_SIZE ((size_t) 1 << 10)
-static const int32_t MAGIC_NUMBER = 1337;
-
 struct FileStorage* fileStorage;
 
 struct FileReader
@@ -35,6 +33,14 @@ void tearDownFileStorage()
     fclose(fileStorage->fileWrite);
     free(fileStorage->freeBlocks);
     free(fileStorage->freeINodes);
+    free(fileStorage->blockRefs);
+    free(fileStorage->blockHashes);
+    free(fileStorage->dedupBuckets);
+    free(fileStorage->dedupNext);
+    for (size_t i = 0; i < CLUSTER_CACHE_SIZE; ++i)
+    {
+        free(fileStorage->clusterCache[i].data);
+    }
     free(fileStorage);
 }
 
@@ -53,13 +59,35 @@ void createFs(int maxSize)
     {
         fileStorage->freeBlocks[i] = i + 3;
     }
-    fileStorage->freeINodesSize = BLOCK_SIZE / sizeof(uint16_t) - 1;
+    fileStorage->freeINodesSize = INODES_COUNT - 1;
     fileStorage->freeINodes = malloc(sizeof(uint16_t) * fileStorage->freeINodesSize);
     fileStorage->nextFreeINode = 0;
     for (uint16_t i = 0; i < fileStorage->freeINodesSize; ++i)
     {
         fileStorage->freeINodes[i] = i + 1;
     }
+    fileStorage->compressionEnabled = false;
+    for (size_t i = 0; i < CLUSTER_CACHE_SIZE; ++i)
+    {
+        memset(fileStorage->clusterCache[i].blocks, 0, sizeof(fileStorage->clusterCache[i].blocks));
+        fileStorage->clusterCache[i].data = malloc(CLUSTER_SIZE);
+    }
+    fileStorage->nextClusterCacheEntry = 0;
+
+    size_t blocksCount = fileStorage->superBlock.blocksCount;
+    fileStorage->deduplicationEnabled = false;
+    fileStorage->blockRefs = calloc(blocksCount, sizeof(uint16_t));
+    fileStorage->blockRefs[2] = 1; // Root directory
+    fileStorage->blockHashes = calloc(blocksCount, sizeof(uint64_t));
+    fileStorage->dedupBucketsSize = 1;
+    while (fileStorage->dedupBucketsSize < blocksCount)
+    {
+        fileStorage->dedupBucketsSize <<= 1;
+    }
+    fileStorage->dedupBuckets = calloc(fileStorage->dedupBucketsSize, sizeof(uint16_t));
+    fileStorage->dedupNext = calloc(blocksCount, sizeof(uint16_t));
+    fileStorage->dedupReferencedBlocks = 0;
+    fileStorage->dedupStoredBlocks = 0;
 
     assert(fwrite(&fileStorage->superBlock, sizeof(struct SuperBlock), 1, fileStorage->fileWrite) == 1);
     size_t zerosSize = BLOCK_SIZE - sizeof(struct SuperBlock);
@@ -72,7 +100,8 @@ void createFs(int maxSize)
     rootDirectoryINode.type = DIRECTORY_;
     rootDirectoryINode.size = 2;
     rootDirectoryINode.linkCounter = 1;
-    memset(rootDirectoryINode.blocks, 0, BLOCKS_COUNT);
+    rootDirectoryINode.flags = 0;
+    memset(rootDirectoryINode.blocks, 0, sizeof(rootDirectoryINode.blocks));
     rootDirectoryINode.blocks[0] = 2;
     assert(fwrite(&rootDirectoryINode, sizeof(rootDirectoryINode), 1, fileStorage->fileWrite) == 1);
 
@@ -87,6 +116,24 @@ void createFs(int maxSize)
     fflush(fileStorage->fileWrite);
 }
 
+void setCompression(bool enabled)
+{
+    fileStorage->compressionEnabled = enabled;
+}
+
+void setDeduplication(bool enabled)
+{
+    fileStorage->deduplicationEnabled = enabled;
+}
+
+struct DeduplicationStats getDeduplicationStats()
+{
+    struct DeduplicationStats stats;
+    stats.referencedBlocks = fileStorage->dedupReferencedBlocks;
+    stats.storedBlocks = fileStorage->dedupStoredBlocks;
+    return stats;
+}
+
 struct INode getINode(uint16_t id)
 {
     struct INode iNode;
@@ -105,12 +152,33 @@ void setINode(uint16_t id, const struct INode* iNode)
 
 void freeINode(uint16_t iNodeId)
 {
+    // Keep freed i-nodes distinguishable from orphaned ones on disk
+    struct INode emptyINode;
+    memset(&emptyINode, 0, sizeof(emptyINode));
+    setINode(iNodeId, &emptyINode);
     fileStorage->freeINodes[--fileStorage->nextFreeINode] = iNodeId;
 }
 
+void invalidateClusterCache(uint16_t blockId)
+{
+    for (size_t i = 0; i < CLUSTER_CACHE_SIZE; ++i)
+    {
+        struct ClusterCacheEntry* entry = &fileStorage->clusterCache[i];
+        for (size_t j = 0; j < CLUSTER_BLOCKS; ++j)
+        {
+            if (entry->blocks[j] == blockId)
+            {
+                memset(entry->blocks, 0, sizeof(entry->blocks));
+                break;
+            }
+        }
+    }
+}
+
 void resetBlock(uint16_t id, size_t size, const void* data)
 {
     assert(size <= BLOCK_SIZE);
+    invalidateClusterCache(id);
     fseek(fileStorage->fileWrite, BLOCK_SIZE * id, SEEK_SET);
     assert(fwrite(data, size, 1, fileStorage->fileWrite) == 1);
     fflush(fileStorage->fileWrite);
@@ -124,14 +192,157 @@ uint16_t createNewBlock(size_t size, const void* data)
     }
     uint16_t idx = fileStorage->freeBlocks[fileStorage->nextFreeBlock++];
     resetBlock(idx, size, data);
+    fileStorage->blockRefs[idx] = 1;
     return idx;
 }
 
 void freeBlock(uint16_t blockId)
 {
+    invalidateClusterCache(blockId);
     fileStorage->freeBlocks[--fileStorage->nextFreeBlock] = blockId;
 }
 
+// FNV-1a, seeded with the size so that equal prefixes of different length don't collide
+uint64_t hashBlock(size_t size, const void* data)
+{
+    uint64_t hash = 14695981039346656037ULL ^ size;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ ((const uint8_t*) data)[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool isBlockEqual(uint16_t id, size_t size, const void* data)
+{
+    uint8_t block[BLOCK_SIZE];
+    fflush(fileStorage->fileRead);
+    fseek(fileStorage->fileRead, BLOCK_SIZE * id, SEEK_SET);
+    return fread(block, 1, size, fileStorage->fileRead) == size && memcmp(block, data, size) == 0;
+}
+
+// Returns an existing block with the same contents if there is one, otherwise writes a new block
+uint16_t createDeduplicatedBlock(size_t size, const void* data)
+{
+    ++fileStorage->dedupReferencedBlocks;
+    uint64_t hash = hashBlock(size, data);
+    uint16_t* bucket = &fileStorage->dedupBuckets[hash & (fileStorage->dedupBucketsSize - 1)];
+    for (uint16_t id = *bucket; id != 0; id = fileStorage->dedupNext[id])
+    {
+        if (fileStorage->blockHashes[id] == hash && isBlockEqual(id, size, data))
+        {
+            ++fileStorage->blockRefs[id];
+            return id;
+        }
+    }
+
+    uint16_t idx = createNewBlock(size, data);
+    ++fileStorage->dedupStoredBlocks;
+    fileStorage->blockHashes[idx] = hash;
+    fileStorage->dedupNext[idx] = *bucket;
+    *bucket = idx;
+    return idx;
+}
+
+// Drops a reference to the block, freeing it once nothing references it
+void releaseBlock(uint16_t blockId)
+{
+    // Only deduplicated blocks are ever shared
+    if (--fileStorage->blockRefs[blockId] > 0)
+    {
+        --fileStorage->dedupReferencedBlocks;
+        return;
+    }
+    uint16_t* next = &fileStorage->dedupBuckets[fileStorage->blockHashes[blockId] & (fileStorage->dedupBucketsSize - 1)];
+    while (*next != 0 && *next != blockId)
+    {
+        next = &fileStorage->dedupNext[*next];
+    }
+    if (*next == blockId)
+    {
+        *next = fileStorage->dedupNext[blockId];
+        --fileStorage->dedupReferencedBlocks;
+        --fileStorage->dedupStoredBlocks;
+    }
+    freeBlock(blockId);
+}
+
+void releaseINodeBlocks(const struct INode* iNode)
+{
+    // Compressed clusters leave zero holes in place of the blocks they saved
+    for (size_t blockNum = 0; blockNum < BLOCKS_COUNT && blockNum * BLOCK_SIZE < iNode->size; ++blockNum)
+    {
+        if (iNode->blocks[blockNum] != 0)
+        {
+            releaseBlock(iNode->blocks[blockNum]);
+        }
+    }
+}
+
+void createNewBlocks(uint16_t* blocks, size_t size, const void* data, bool deduplicate)
+{
+    while (size > 0)
+    {
+        size_t sizeToWrite = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+        *blocks++ = deduplicate ? createDeduplicatedBlock(sizeToWrite, data) : createNewBlock(sizeToWrite, data);
+        data += sizeToWrite;
+        size -= sizeToWrite;
+    }
+}
+
+// Writes the contents of a compressed or deduplicated i-node into new blocks. The old blocks of a deduplicated
+// i-node are released only afterwards, so that unchanged blocks are shared instead of being written again;
+// other i-nodes release them first and need no room for both contents at once.
+// Each cluster of a compressed i-node occupies the same block slots as it would uncompressed, see layout.h.
+void rewriteINode(uint16_t id, struct INode* iNode, const void* newData, size_t oldSize)
+{
+    if (iNode->size > BLOCKS_COUNT * BLOCK_SIZE)
+    {
+        raise(SIGUSR1);
+    }
+    struct INode oldINode = *iNode;
+    oldINode.size = (uint32_t) oldSize;
+    memset(iNode->blocks, 0, sizeof(iNode->blocks));
+    bool deduplicate = iNode->flags & INODE_DEDUPLICATED;
+    if (!deduplicate)
+    {
+        releaseINodeBlocks(&oldINode);
+    }
+    if (!(iNode->flags & INODE_COMPRESSED))
+    {
+        createNewBlocks(iNode->blocks, iNode->size, newData, deduplicate);
+        setINode(id, iNode);
+        if (deduplicate)
+        {
+            releaseINodeBlocks(&oldINode);
+        }
+        return;
+    }
+
+    uint8_t* buff = malloc(CLUSTER_SIZE);
+    for (size_t clusterNum = 0; clusterNum * CLUSTER_SIZE < iNode->size; ++clusterNum)
+    {
+        const void* clusterData = newData + clusterNum * CLUSTER_SIZE;
+        size_t clusterSize = getClusterSize(iNode, clusterNum);
+        uint16_t* blocks = iNode->blocks + clusterNum * CLUSTER_BLOCKS;
+        size_t storedSize = compressCluster(clusterData, clusterSize, buff);
+        if (storedSize > 0)
+        {
+            createNewBlocks(blocks, storedSize, buff, deduplicate);
+        }
+        else
+        {
+            createNewBlocks(blocks, clusterSize, clusterData, deduplicate);
+        }
+    }
+    free(buff);
+    setINode(id, iNode);
+    if (deduplicate)
+    {
+        releaseINodeBlocks(&oldINode);
+    }
+}
+
 void resetINode(uint16_t id, struct INode* iNode, const void* newData)
 {
     size_t size = iNode->size;
@@ -159,7 +370,16 @@ void resetINode(uint16_t id, struct INode* iNode, const void* newData)
         newData += sizeToWrite;
         size -= sizeToWrite;
     }
-    iNode->blocks[i] = 0;
+    // Release the tail left over from a longer previous contents
+    for (size_t j = i; isBlockUsed && j < BLOCKS_COUNT && iNode->blocks[j] != 0; ++j)
+    {
+        releaseBlock(iNode->blocks[j]);
+        iNode->blocks[j] = 0;
+    }
+    if (i < BLOCKS_COUNT)
+    {
+        iNode->blocks[i] = 0;
+    }
     setINode(id, iNode);
 }
 
@@ -172,10 +392,58 @@ uint16_t createNewINode(struct INode* iNode, const void* data)
     uint16_t idx = fileStorage->freeINodes[fileStorage->nextFreeINode++];
     iNode->linkCounter = 1;
     iNode->blocks[0] = 0;
-    resetINode(idx, iNode, data);
+    iNode->flags = 0;
+    if (iNode->type == FILE_ && fileStorage->compressionEnabled)
+    {
+        iNode->flags |= INODE_COMPRESSED;
+    }
+    if (iNode->type == FILE_ && fileStorage->deduplicationEnabled)
+    {
+        iNode->flags |= INODE_DEDUPLICATED;
+    }
+    if (iNode->flags != 0)
+    {
+        rewriteINode(idx, iNode, data, 0);
+    }
+    else
+    {
+        resetINode(idx, iNode, data);
+    }
     return idx;
 }
 
+const void* getDecompressedCluster(const struct INode* iNode, size_t clusterNum)
+{
+    const uint16_t* blocks = iNode->blocks + clusterNum * CLUSTER_BLOCKS;
+    for (size_t i = 0; i < CLUSTER_CACHE_SIZE; ++i)
+    {
+        if (memcmp(fileStorage->clusterCache[i].blocks, blocks, sizeof(fileStorage->clusterCache[i].blocks)) == 0)
+        {
+            return fileStorage->clusterCache[i].data;
+        }
+    }
+
+    uint8_t stored[CLUSTER_SIZE];
+    size_t storedSize = 0;
+    for (size_t i = 0; i < getClusterUsedBlocksCount(iNode, clusterNum); ++i)
+    {
+        fflush(fileStorage->fileRead);
+        fseek(fileStorage->fileRead, blocks[i] * BLOCK_SIZE, SEEK_SET);
+        storedSize += fread(stored + storedSize, 1, BLOCK_SIZE, fileStorage->fileRead);
+    }
+
+    struct ClusterCacheEntry* entry = &fileStorage->clusterCache[fileStorage->nextClusterCacheEntry];
+    fileStorage->nextClusterCacheEntry = (fileStorage->nextClusterCacheEntry + 1) % CLUSTER_CACHE_SIZE;
+    memset(entry->blocks, 0, sizeof(entry->blocks));
+    size_t size = decompressCluster(stored, storedSize, entry->data);
+    if (size == 0 || size != getClusterSize(iNode, clusterNum))
+    {
+        raise(SIGUSR1);
+    }
+    memcpy(entry->blocks, blocks, sizeof(entry->blocks));
+    return entry->data;
+}
+
 size_t readFromFile(struct FileReader* fileReader, void* dest, size_t size)
 {
     if (fileReader->pos + size > fileReader->iNode->size)
@@ -185,6 +453,19 @@ size_t readFromFile(struct FileReader* fileReader, void* dest, size_t size)
     size_t result = 0;
     while (size > 0)
     {
+        size_t clusterNum = fileReader->pos / CLUSTER_SIZE;
+        if (isClusterCompressed(fileReader->iNode, clusterNum))
+        {
+            size_t start = fileReader->pos - clusterNum * CLUSTER_SIZE;
+            size_t bytesToRead = size < CLUSTER_SIZE - start ? size : CLUSTER_SIZE - start;
+            memcpy(dest, getDecompressedCluster(fileReader->iNode, clusterNum) + start, bytesToRead);
+            result += bytesToRead;
+            dest += bytesToRead;
+            fileReader->pos += bytesToRead;
+            size -= bytesToRead;
+            continue;
+        }
+
         size_t blockNum = fileReader->pos / BLOCK_SIZE;
         size_t start = fileReader->pos - blockNum * BLOCK_SIZE;
         size_t bytesToRead = size;
@@ -373,8 +654,16 @@ uint16_t getFileNodeId(const char* path, const char* contents)
         {
             raise(SIGUSR1);
         }
+        uint32_t oldSize = newINode.size;
         newINode.size = strlen(contents) + 1; // null-termination
-        resetINode(fileNodeId, &newINode, contents);
+        if (newINode.flags != 0)
+        {
+            rewriteINode(fileNodeId, &newINode, contents, oldSize);
+        }
+        else
+        {
+            resetINode(fileNodeId, &newINode, contents);
+        }
     }
 
     return fileNodeId;
@@ -451,10 +740,7 @@ void rmImpl(const char* path, Type type)
         }
         else
         {
-            for (size_t blockNum = 0; blockNum * BLOCK_SIZE < iNodeToRemove.size; ++blockNum)
-            {
-                freeBlock(iNodeToRemove.blocks[blockNum]);
-            }
+            releaseINodeBlocks(&iNodeToRemove);
             freeINode(fileNodeId);
         }
 
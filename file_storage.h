@@ -2,9 +2,19 @@
 
 #include "structs.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#define CLUSTER_CACHE_SIZE 8
+
+struct ClusterCacheEntry
+{
+    // Blocks of the compressed cluster, all zeros for an empty entry
+    uint16_t blocks[CLUSTER_BLOCKS];
+    void* data;
+};
+
 struct FileStorage
 {
     FILE* fileRead;
@@ -16,6 +26,26 @@ struct FileStorage
     uint16_t* freeINodes;
     size_t freeINodesSize;
     size_t nextFreeINode;
+    bool compressionEnabled;
+    struct ClusterCacheEntry clusterCache[CLUSTER_CACHE_SIZE];
+    size_t nextClusterCacheEntry;
+    bool deduplicationEnabled;
+    // Number of i-node references to every block
+    uint16_t* blockRefs;
+    // Fingerprint index of deduplicated blocks: hash buckets chained through dedupNext
+    uint64_t* blockHashes;
+    uint16_t* dedupBuckets;
+    size_t dedupBucketsSize;
+    uint16_t* dedupNext;
+    size_t dedupReferencedBlocks;
+    size_t dedupStoredBlocks;
+};
+
+struct DeduplicationStats
+{
+    // Blocks currently referenced by deduplicated files and distinct blocks on disk holding them
+    size_t referencedBlocks;
+    size_t storedBlocks;
 };
 
 void initFileStorage(const char* fileName);
@@ -24,6 +54,14 @@ void tearDownFileStorage();
 
 void createFs(int maxSize);
 
+// Files created while compression is enabled keep their contents compressed
+void setCompression(bool enabled);
+
+// Files created while deduplication is enabled share blocks with identical contents
+void setDeduplication(bool enabled);
+
+struct DeduplicationStats getDeduplicationStats();
+
 void ls(const char* directory, size_t maxFileCount, char dest[][NAME_MAX_LENGTH]);
 
 void mkdir(const char* path);
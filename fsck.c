@@ -0,0 +1,658 @@
+#include "layout.h"
+#include "structs.h"
+
+#include <memory.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define PROBLEM_MAX_LENGTH 128
+// Blocks 0 and 1 hold the super block and the i-nodes, block 2 is where the root directory starts
+#define FIRST_DATA_BLOCK 2
+
+struct INodeInfo
+{
+    bool isBad;
+    // Why the i-node is bad, reported once the repair decision is known
+    char problem[PROBLEM_MAX_LENGTH];
+    // Updated by the parallel directory tree walk
+    atomic_bool isReachable;
+    atomic_uint_least16_t directoryRefs;
+    // Parsed directory entries, NULL for files
+    struct FileListEntry* entries;
+    uint16_t entriesCount;
+    // Dangling entries were dropped, so the directory has to be written back
+    bool isChanged;
+};
+
+struct Fsck
+{
+    uint8_t* image;
+    size_t imageSize;
+    struct SuperBlock superBlock;
+    size_t threadsCount;
+    bool repair;
+    struct INodeInfo iNodeInfos[INODES_COUNT];
+    // Rebuilt allocation bitmaps
+    bool usedINodes[INODES_COUNT];
+    bool* usedBlocks;
+    // Blocks referenced by an i-node that is not deduplicated and so may not be shared
+    bool* exclusiveBlocks;
+    size_t deduplicatedRefsCount;
+    // I-nodes at the current depth of the directory tree walk and the ones found below them
+    uint16_t directoryLevel[INODES_COUNT];
+    uint16_t nextDirectoryLevel[INODES_COUNT];
+    atomic_size_t nextDirectoryLevelSize;
+    // Copy of the image being defragmented and the new place of every block, 0 for unused blocks
+    uint8_t* defragmentSource;
+    uint16_t* defragmentMap;
+    size_t errorsCount;
+    size_t repairedCount;
+    pthread_mutex_t reportMutex;
+};
+
+struct ParallelTask
+{
+    struct Fsck* fsck;
+    void (*function)(struct Fsck*, size_t);
+    size_t count;
+    atomic_size_t next;
+};
+
+static void report(struct Fsck* fsck, bool repaired, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&fsck->reportMutex);
+    ++fsck->errorsCount;
+    if (repaired)
+    {
+        ++fsck->repairedCount;
+    }
+    vprintf(format, args);
+    printf(repaired ? " (repaired)\n" : "\n");
+    pthread_mutex_unlock(&fsck->reportMutex);
+    va_end(args);
+}
+
+static void markBad(struct INodeInfo* info, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(info->problem, sizeof(info->problem), format, args);
+    va_end(args);
+    info->isBad = true;
+}
+
+static double getTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+static void* runParallelWorker(void* arg)
+{
+    struct ParallelTask* task = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&task->next, 1)) < task->count)
+    {
+        task->function(task->fsck, i);
+    }
+    return NULL;
+}
+
+// Calls function for every index in [0, count), spreading the indices over the worker threads
+static void runParallel(struct Fsck* fsck, size_t count, void (*function)(struct Fsck*, size_t))
+{
+    struct ParallelTask task;
+    task.fsck = fsck;
+    task.function = function;
+    task.count = count;
+    atomic_init(&task.next, 0);
+
+    pthread_t threads[MAX_THREADS];
+    for (size_t i = 1; i < fsck->threadsCount; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, runParallelWorker, &task) != 0)
+        {
+            fputs("Failed to start a thread\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    runParallelWorker(&task);
+    for (size_t i = 1; i < fsck->threadsCount; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static struct INode* getINode(struct Fsck* fsck, size_t id)
+{
+    return (struct INode*) (fsck->image + BLOCK_SIZE + id * sizeof(struct INode));
+}
+
+static bool isValidBlock(struct Fsck* fsck, uint16_t blockId)
+{
+    return blockId >= FIRST_DATA_BLOCK && blockId < fsck->superBlock.blocksCount;
+}
+
+// Copies the contents of an uncompressed i-node into dest
+static void readINode(struct Fsck* fsck, const struct INode* iNode, void* dest)
+{
+    for (size_t offset = 0; offset < iNode->size; offset += BLOCK_SIZE)
+    {
+        size_t size = iNode->size - offset < BLOCK_SIZE ? iNode->size - offset : BLOCK_SIZE;
+        memcpy(dest + offset, fsck->image + iNode->blocks[offset / BLOCK_SIZE] * BLOCK_SIZE, size);
+    }
+}
+
+static void writeINode(struct Fsck* fsck, const struct INode* iNode, const void* src)
+{
+    for (size_t offset = 0; offset < iNode->size; offset += BLOCK_SIZE)
+    {
+        size_t size = iNode->size - offset < BLOCK_SIZE ? iNode->size - offset : BLOCK_SIZE;
+        memcpy(fsck->image + iNode->blocks[offset / BLOCK_SIZE] * BLOCK_SIZE, src + offset, size);
+    }
+}
+
+static bool checkCompressedCluster(struct Fsck* fsck, const struct INode* iNode, size_t clusterNum)
+{
+    if (!isClusterCompressed(iNode, clusterNum))
+    {
+        return true;
+    }
+    size_t usedBlocksCount = getClusterUsedBlocksCount(iNode, clusterNum);
+    // A compressed cluster keeps at least its size header in the first block
+    if (usedBlocksCount == 0)
+    {
+        return false;
+    }
+    uint8_t stored[CLUSTER_SIZE];
+    for (size_t i = 0; i < usedBlocksCount; ++i)
+    {
+        uint16_t blockId = iNode->blocks[clusterNum * CLUSTER_BLOCKS + i];
+        memcpy(stored + i * BLOCK_SIZE, fsck->image + blockId * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    uint8_t decompressed[CLUSTER_SIZE];
+    size_t size = decompressCluster(stored, usedBlocksCount * BLOCK_SIZE, decompressed);
+    return size != 0 && size == getClusterSize(iNode, clusterNum);
+}
+
+static void checkINode(struct Fsck* fsck, size_t id)
+{
+    struct INode* iNode = getINode(fsck, id);
+    struct INodeInfo* info = &fsck->iNodeInfos[id];
+    if (iNode->type == EMPTY)
+    {
+        return;
+    }
+    if (iNode->type != DIRECTORY_ && iNode->type != FILE_)
+    {
+        markBad(info, "I-node %zu has unknown type %u", id, iNode->type);
+        return;
+    }
+    if (iNode->size > BLOCKS_COUNT * BLOCK_SIZE)
+    {
+        markBad(info, "I-node %zu is too large: %u bytes", id, iNode->size);
+        return;
+    }
+    if (iNode->type == DIRECTORY_ && iNode->flags != 0)
+    {
+        markBad(info, "Directory i-node %zu has flags %#x", id, iNode->flags);
+        return;
+    }
+    if (iNode->flags & ~(INODE_COMPRESSED | INODE_DEDUPLICATED))
+    {
+        markBad(info, "I-node %zu has unknown flags %#x", id, iNode->flags);
+        return;
+    }
+    bool isCompressed = iNode->flags & INODE_COMPRESSED;
+    for (size_t blockNum = 0; blockNum < getBlocksCount(iNode->size); ++blockNum)
+    {
+        uint16_t blockId = iNode->blocks[blockNum];
+        if ((blockId != 0 || !isCompressed) && !isValidBlock(fsck, blockId))
+        {
+            markBad(info, "I-node %zu references invalid block %u", id, blockId);
+            return;
+        }
+    }
+    for (size_t clusterNum = 0; isCompressed && clusterNum * CLUSTER_SIZE < iNode->size; ++clusterNum)
+    {
+        if (!checkCompressedCluster(fsck, iNode, clusterNum))
+        {
+            markBad(info, "I-node %zu has corrupted compressed cluster %zu", id, clusterNum);
+            return;
+        }
+    }
+
+    if (iNode->type == DIRECTORY_)
+    {
+        uint16_t len = 0;
+        uint8_t* contents = malloc(iNode->size);
+        readINode(fsck, iNode, contents);
+        if (iNode->size >= sizeof(len))
+        {
+            memcpy(&len, contents, sizeof(len));
+        }
+        if (iNode->size != sizeof(len) + len * sizeof(struct FileListEntry))
+        {
+            markBad(info, "Directory i-node %zu has size %u inconsistent with its entries", id, iNode->size);
+            free(contents);
+            return;
+        }
+        info->entries = malloc(len * sizeof(struct FileListEntry));
+        memcpy(info->entries, contents + sizeof(len), len * sizeof(struct FileListEntry));
+        info->entriesCount = len;
+        free(contents);
+    }
+}
+
+static void rewriteDirectory(struct Fsck* fsck, size_t id)
+{
+    struct INode* iNode = getINode(fsck, id);
+    struct INodeInfo* info = &fsck->iNodeInfos[id];
+    uint8_t* contents = malloc(iNode->size);
+    memcpy(contents, &info->entriesCount, sizeof(info->entriesCount));
+    memcpy(contents + sizeof(info->entriesCount), info->entries, info->entriesCount * sizeof(struct FileListEntry));
+    size_t oldBlocksCount = getBlocksCount(iNode->size);
+    iNode->size = sizeof(info->entriesCount) + info->entriesCount * sizeof(struct FileListEntry);
+    writeINode(fsck, iNode, contents);
+    for (size_t blockNum = getBlocksCount(iNode->size); blockNum < oldBlocksCount; ++blockNum)
+    {
+        iNode->blocks[blockNum] = 0;
+    }
+    free(contents);
+}
+
+static void checkDirectory(struct Fsck* fsck, size_t index)
+{
+    uint16_t id = fsck->directoryLevel[index];
+    struct INodeInfo* info = &fsck->iNodeInfos[id];
+    for (uint16_t t = 0; t < info->entriesCount; ++t)
+    {
+        struct FileListEntry* entry = &info->entries[t];
+        entry->name[NAME_MAX_LENGTH - 1] = '\0';
+        uint16_t childId = entry->iNodeId;
+        if (childId == 0 || childId >= INODES_COUNT || getINode(fsck, childId)->type == EMPTY
+            || fsck->iNodeInfos[childId].isBad)
+        {
+            report(fsck, fsck->repair, "Directory i-node %u has dangling entry %s -> %u", id, entry->name, childId);
+            if (fsck->repair)
+            {
+                memmove(entry, entry + 1, (info->entriesCount - t - 1) * sizeof(struct FileListEntry));
+                --info->entriesCount;
+                --t;
+                info->isChanged = true;
+            }
+            continue;
+        }
+        atomic_fetch_add(&fsck->iNodeInfos[childId].directoryRefs, 1);
+        // Only the first directory to reach the i-node walks it further
+        if (!atomic_exchange(&fsck->iNodeInfos[childId].isReachable, true))
+        {
+            fsck->nextDirectoryLevel[atomic_fetch_add(&fsck->nextDirectoryLevelSize, 1)] = childId;
+        }
+    }
+}
+
+// Walks the directory tree from the root one level at a time, counting references to every i-node
+static void checkDirectoryTree(struct Fsck* fsck)
+{
+    atomic_store(&fsck->iNodeInfos[0].isReachable, true);
+    fsck->directoryLevel[0] = 0;
+    size_t levelSize = 1;
+    while (levelSize > 0)
+    {
+        atomic_store(&fsck->nextDirectoryLevelSize, 0);
+        runParallel(fsck, levelSize, checkDirectory);
+        levelSize = atomic_load(&fsck->nextDirectoryLevelSize);
+        memcpy(fsck->directoryLevel, fsck->nextDirectoryLevel, levelSize * sizeof(uint16_t));
+    }
+    // Written back once the walk is over, so that no thread reads the i-node table while it changes
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        if (fsck->iNodeInfos[id].isChanged)
+        {
+            rewriteDirectory(fsck, id);
+        }
+    }
+}
+
+static void rebuildBitmaps(struct Fsck* fsck)
+{
+    memset(fsck->usedINodes, 0, sizeof(fsck->usedINodes));
+    memset(fsck->usedBlocks, 0, fsck->superBlock.blocksCount * sizeof(bool));
+    memset(fsck->exclusiveBlocks, 0, fsck->superBlock.blocksCount * sizeof(bool));
+    fsck->deduplicatedRefsCount = 0;
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        struct INode* iNode = getINode(fsck, id);
+        if (iNode->type == EMPTY || !fsck->iNodeInfos[id].isReachable || fsck->iNodeInfos[id].isBad)
+        {
+            continue;
+        }
+        fsck->usedINodes[id] = true;
+        bool isDeduplicated = iNode->flags & INODE_DEDUPLICATED;
+        for (size_t blockNum = 0; blockNum < getBlocksCount(iNode->size); ++blockNum)
+        {
+            uint16_t blockId = iNode->blocks[blockNum];
+            if (blockId == 0)
+            {
+                continue;
+            }
+            if (fsck->usedBlocks[blockId] && (!isDeduplicated || fsck->exclusiveBlocks[blockId]))
+            {
+                report(fsck, false, "Block %u is referenced more than once, last by i-node %zu", blockId, id);
+            }
+            fsck->usedBlocks[blockId] = true;
+            fsck->exclusiveBlocks[blockId] |= !isDeduplicated;
+            fsck->deduplicatedRefsCount += isDeduplicated;
+        }
+    }
+}
+
+static void checkINodes(struct Fsck* fsck)
+{
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        struct INode* iNode = getINode(fsck, id);
+        struct INodeInfo* info = &fsck->iNodeInfos[id];
+        if (iNode->type == EMPTY)
+        {
+            continue;
+        }
+        if (info->isBad)
+        {
+            report(fsck, fsck->repair, "%s", info->problem);
+            if (fsck->repair)
+            {
+                memset(iNode, 0, sizeof(*iNode));
+            }
+            continue;
+        }
+        if (!info->isReachable)
+        {
+            size_t leakedBlocksCount = 0;
+            for (size_t blockNum = 0; blockNum < getBlocksCount(iNode->size); ++blockNum)
+            {
+                uint16_t blockId = iNode->blocks[blockNum];
+                leakedBlocksCount += blockId != 0 && !fsck->usedBlocks[blockId];
+            }
+            report(fsck, fsck->repair, "I-node %zu is orphaned, leaking %zu blocks", id, leakedBlocksCount);
+            if (fsck->repair)
+            {
+                memset(iNode, 0, sizeof(*iNode));
+            }
+            continue;
+        }
+        // The root directory is referenced by the file system itself
+        uint16_t expectedLinkCounter = id == 0 ? 1 : info->directoryRefs;
+        if (iNode->linkCounter != expectedLinkCounter)
+        {
+            report(fsck, fsck->repair, "I-node %zu has link counter %u, but %u references",
+                   id, iNode->linkCounter, expectedLinkCounter);
+            if (fsck->repair)
+            {
+                iNode->linkCounter = expectedLinkCounter;
+            }
+        }
+    }
+}
+
+// Share of consecutive block pairs of the files that are not adjacent on disk, in percent
+static double getFragmentationScore(struct Fsck* fsck)
+{
+    size_t pairsCount = 0;
+    size_t fragmentedPairsCount = 0;
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        struct INode* iNode = getINode(fsck, id);
+        if (!fsck->usedINodes[id])
+        {
+            continue;
+        }
+        uint16_t previous = 0;
+        for (size_t blockNum = 0; blockNum < getBlocksCount(iNode->size); ++blockNum)
+        {
+            uint16_t blockId = iNode->blocks[blockNum];
+            if (blockId == 0)
+            {
+                continue;
+            }
+            if (previous != 0)
+            {
+                ++pairsCount;
+                fragmentedPairsCount += blockId != previous + 1;
+            }
+            previous = blockId;
+        }
+    }
+    return pairsCount == 0 ? 0 : 100.0 * (double) fragmentedPairsCount / (double) pairsCount;
+}
+
+static void moveBlock(struct Fsck* fsck, size_t blockId)
+{
+    if (fsck->defragmentMap[blockId] != 0)
+    {
+        memcpy(fsck->image + fsck->defragmentMap[blockId] * BLOCK_SIZE,
+               fsck->defragmentSource + blockId * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+// Lays out the blocks of every file contiguously, in the order of i-nodes
+static size_t defragment(struct Fsck* fsck)
+{
+    size_t blocksCount = fsck->superBlock.blocksCount;
+    fsck->defragmentMap = calloc(blocksCount, sizeof(uint16_t));
+    uint16_t nextBlock = FIRST_DATA_BLOCK;
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        struct INode* iNode = getINode(fsck, id);
+        for (size_t blockNum = 0; fsck->usedINodes[id] && blockNum < getBlocksCount(iNode->size); ++blockNum)
+        {
+            uint16_t blockId = iNode->blocks[blockNum];
+            if (blockId != 0 && fsck->defragmentMap[blockId] == 0)
+            {
+                fsck->defragmentMap[blockId] = nextBlock++;
+            }
+        }
+    }
+
+    fsck->defragmentSource = malloc(fsck->imageSize);
+    memcpy(fsck->defragmentSource, fsck->image, fsck->imageSize);
+    memset(fsck->image + FIRST_DATA_BLOCK * BLOCK_SIZE, 0, (blocksCount - FIRST_DATA_BLOCK) * BLOCK_SIZE);
+    runParallel(fsck, blocksCount, moveBlock);
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        struct INode* iNode = getINode(fsck, id);
+        for (size_t blockNum = 0; fsck->usedINodes[id] && blockNum < getBlocksCount(iNode->size); ++blockNum)
+        {
+            iNode->blocks[blockNum] = fsck->defragmentMap[iNode->blocks[blockNum]];
+        }
+    }
+    memset(fsck->usedBlocks, 0, blocksCount * sizeof(bool));
+    for (uint16_t blockId = FIRST_DATA_BLOCK; blockId < nextBlock; ++blockId)
+    {
+        fsck->usedBlocks[blockId] = true;
+    }
+
+    free(fsck->defragmentSource);
+    free(fsck->defragmentMap);
+    return nextBlock - FIRST_DATA_BLOCK;
+}
+
+static size_t countTrue(const bool* values, size_t count)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        result += values[i];
+    }
+    return result;
+}
+
+static void loadImage(struct Fsck* fsck, const char* fileName)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    fsck->imageSize = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    fsck->image = malloc(fsck->imageSize + 1);
+    if (fread(fsck->image, 1, fsck->imageSize, file) != fsck->imageSize)
+    {
+        fprintf(stderr, "Can't read %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    if (fsck->imageSize < 2 * BLOCK_SIZE)
+    {
+        fputs("Image is too small\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&fsck->superBlock, fsck->image, sizeof(fsck->superBlock));
+    if (fsck->superBlock.magicNumber != MAGIC_NUMBER || fsck->superBlock.sizeOfINode != sizeof(struct INode)
+        || fsck->superBlock.blocksCount * BLOCK_SIZE > fsck->imageSize
+        || fsck->superBlock.blocksCount <= FIRST_DATA_BLOCK)
+    {
+        fputs("Bad super block\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void saveImage(struct Fsck* fsck, const char* fileName)
+{
+    FILE* file = fopen(fileName, "r+b");
+    if (file == NULL || fwrite(fsck->image, 1, fsck->imageSize, file) != fsck->imageSize
+        || fflush(file) != 0 || fsync(fileno(file)) != 0)
+    {
+        fprintf(stderr, "Can't write %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+    struct Fsck* fsck = calloc(1, sizeof(*fsck));
+    long processorsCount = sysconf(_SC_NPROCESSORS_ONLN);
+    fsck->threadsCount = processorsCount > 0 ? (size_t) processorsCount : 1;
+    bool defragmentation = false;
+    const char* fileName = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--repair") == 0)
+        {
+            fsck->repair = true;
+        }
+        else if (strcmp(argv[i], "--defrag") == 0)
+        {
+            defragmentation = true;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            fsck->threadsCount = (size_t) atoi(argv[++i]);
+        }
+        else if (fileName == NULL)
+        {
+            fileName = argv[i];
+        }
+        else
+        {
+            fileName = NULL;
+            break;
+        }
+    }
+    if (fileName == NULL || fsck->threadsCount == 0)
+    {
+        fputs("Usage: minifs_fsck [-j threads] [--repair] [--defrag] image\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if (fsck->threadsCount > MAX_THREADS)
+    {
+        fsck->threadsCount = MAX_THREADS;
+    }
+    pthread_mutex_init(&fsck->reportMutex, NULL);
+
+    double start = getTime();
+    loadImage(fsck, fileName);
+    double readElapsed = getTime() - start;
+    size_t blocksCount = fsck->superBlock.blocksCount;
+    fsck->usedBlocks = calloc(blocksCount, sizeof(bool));
+    fsck->exclusiveBlocks = calloc(blocksCount, sizeof(bool));
+    printf("Checking %s: %zu blocks, %zu i-nodes, %zu threads\n", fileName, blocksCount, INODES_COUNT,
+           fsck->threadsCount);
+
+    runParallel(fsck, INODES_COUNT, checkINode);
+    if (getINode(fsck, 0)->type != DIRECTORY_ || fsck->iNodeInfos[0].isBad)
+    {
+        fputs("Root directory is corrupted\n", stderr);
+        if (fsck->iNodeInfos[0].isBad)
+        {
+            fprintf(stderr, "%s\n", fsck->iNodeInfos[0].problem);
+        }
+        return EXIT_FAILURE;
+    }
+    checkDirectoryTree(fsck);
+    rebuildBitmaps(fsck);
+    checkINodes(fsck);
+    double elapsed = getTime() - start;
+    printf("Checked %zu KiB in %.3f ms (%.3f ms reading the image), %.1f MiB/s\n", fsck->imageSize >> 10,
+           elapsed * 1e3, readElapsed * 1e3, (double) fsck->imageSize / (1 << 20) / elapsed);
+
+    size_t usedINodesCount = countTrue(fsck->usedINodes, INODES_COUNT);
+    size_t usedBlocksCount = countTrue(fsck->usedBlocks, blocksCount);
+    printf("I-nodes: %zu used, %zu free\n", usedINodesCount, INODES_COUNT - usedINodesCount);
+    printf("Blocks: %zu used, %zu free\n", usedBlocksCount, blocksCount - FIRST_DATA_BLOCK - usedBlocksCount);
+    size_t deduplicatedBlocksCount = usedBlocksCount - countTrue(fsck->exclusiveBlocks, blocksCount);
+    printf("Deduplication: %zu references to %zu blocks, ratio %.2f\n", fsck->deduplicatedRefsCount,
+           deduplicatedBlocksCount,
+           deduplicatedBlocksCount == 0 ? 1.0 : (double) fsck->deduplicatedRefsCount / (double) deduplicatedBlocksCount);
+    printf("Fragmentation: %.2f%%\n", getFragmentationScore(fsck));
+
+    bool isConsistent = fsck->errorsCount == fsck->repairedCount;
+    if (defragmentation && !isConsistent)
+    {
+        puts("Skipping defragmentation of an inconsistent image");
+    }
+    else if (defragmentation)
+    {
+        start = getTime();
+        size_t movedBlocksCount = defragment(fsck);
+        double writeStart = getTime();
+        saveImage(fsck, fileName);
+        double end = getTime();
+        elapsed = end - start;
+        printf("Defragmented %zu blocks in %.3f ms (%.3f ms writing the image), %.1f MiB/s\n", movedBlocksCount,
+               elapsed * 1e3, (end - writeStart) * 1e3, (double) (movedBlocksCount * BLOCK_SIZE) / (1 << 20) / elapsed);
+        printf("Fragmentation after defragmentation: %.2f%%\n", getFragmentationScore(fsck));
+    }
+    else if (fsck->repairedCount > 0)
+    {
+        saveImage(fsck, fileName);
+    }
+    printf("Errors: %zu found, %zu repaired\n", fsck->errorsCount, fsck->repairedCount);
+
+    for (size_t id = 0; id < INODES_COUNT; ++id)
+    {
+        free(fsck->iNodeInfos[id].entries);
+    }
+    free(fsck->usedBlocks);
+    free(fsck->exclusiveBlocks);
+    free(fsck->image);
+    pthread_mutex_destroy(&fsck->reportMutex);
+    free(fsck);
+    return isConsistent ? EXIT_SUCCESS : EXIT_FAILURE;
+}
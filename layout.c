@@ -0,0 +1,70 @@
+#include "layout.h"
+
+#include "compression.h"
+
+#include <memory.h>
+
+typedef uint16_t ClusterHeader;
+
+size_t getBlocksCount(size_t size)
+{
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+size_t getClusterSize(const struct INode* iNode, size_t clusterNum)
+{
+    size_t offset = clusterNum * CLUSTER_SIZE;
+    return iNode->size - offset < CLUSTER_SIZE ? iNode->size - offset : CLUSTER_SIZE;
+}
+
+size_t getClusterUsedBlocksCount(const struct INode* iNode, size_t clusterNum)
+{
+    size_t usedBlocksCount = 0;
+    while (usedBlocksCount < CLUSTER_BLOCKS && iNode->blocks[clusterNum * CLUSTER_BLOCKS + usedBlocksCount] != 0)
+    {
+        ++usedBlocksCount;
+    }
+    return usedBlocksCount;
+}
+
+bool isClusterCompressed(const struct INode* iNode, size_t clusterNum)
+{
+    if (!(iNode->flags & INODE_COMPRESSED))
+    {
+        return false;
+    }
+    return getClusterUsedBlocksCount(iNode, clusterNum) < getBlocksCount(getClusterSize(iNode, clusterNum));
+}
+
+size_t compressCluster(const void* cluster, size_t clusterSize, void* dest)
+{
+    size_t rawBlocksCount = getBlocksCount(clusterSize);
+    if (rawBlocksCount <= 1)
+    {
+        return 0;
+    }
+    size_t compressedSize = compressBuffer(cluster, clusterSize, dest + sizeof(ClusterHeader),
+                                           (rawBlocksCount - 1) * BLOCK_SIZE - sizeof(ClusterHeader));
+    if (compressedSize == 0)
+    {
+        return 0;
+    }
+    ClusterHeader header = (ClusterHeader) compressedSize;
+    memcpy(dest, &header, sizeof(header));
+    return sizeof(header) + compressedSize;
+}
+
+size_t decompressCluster(const void* stored, size_t storedSize, void* dest)
+{
+    ClusterHeader header;
+    if (storedSize < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, stored, sizeof(header));
+    if (storedSize < sizeof(header) + header)
+    {
+        return 0;
+    }
+    return decompressBuffer(stored + sizeof(header), header, dest, CLUSTER_SIZE);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "structs.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// On-disk layout of i-node contents, shared by the file system and the offline checker
+
+size_t getBlocksCount(size_t size);
+
+// The last cluster of a file may be shorter than CLUSTER_SIZE
+size_t getClusterSize(const struct INode* iNode, size_t clusterNum);
+
+// Number of leading non-zero block slots of the cluster
+size_t getClusterUsedBlocksCount(const struct INode* iNode, size_t clusterNum);
+
+// A cluster of a compressed i-node is stored compressed when it occupies fewer blocks than its raw contents need
+bool isClusterCompressed(const struct INode* iNode, size_t clusterNum);
+
+// Stores the cluster into dest as its compressed size followed by the compressed data.
+// Returns the stored size, or 0 if compression doesn't save a block and the cluster should be stored raw.
+size_t compressCluster(const void* cluster, size_t clusterSize, void* dest);
+
+// Returns the decompressed size, or 0 if the stored cluster is malformed
+size_t decompressCluster(const void* stored, size_t storedSize, void* dest);
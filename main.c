@@ -83,6 +83,22 @@ int main(int argc, char** argv)
             assert(scanf("%s", contents));
             ln(command, contents);
         }
+        else if (strcmp(command, "set_compression") == 0)
+        {
+            assert(scanf("%s", command));
+            setCompression(strcmp(command, "on") == 0);
+        }
+        else if (strcmp(command, "set_dedup") == 0)
+        {
+            assert(scanf("%s", command));
+            setDeduplication(strcmp(command, "on") == 0);
+        }
+        else if (strcmp(command, "dedup_stats") == 0)
+        {
+            struct DeduplicationStats stats = getDeduplicationStats();
+            printf("%zu blocks referenced, %zu stored, ratio %.2f\n", stats.referencedBlocks, stats.storedBlocks,
+                   stats.storedBlocks == 0 ? 1.0 : (double) stats.referencedBlocks / (double) stats.storedBlocks);
+        }
         else
         {
             fprintf(stderr, "Unknown command %s\n", command);
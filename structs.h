@@ -2,8 +2,14 @@
 #include <assert.h>
 #include <stdint.h>
 
+#define BLOCK_SIZE ((size_t) 1 << 10)
 #define NAME_MAX_LENGTH 14
 #define BLOCKS_COUNT 12
+// Compressed files are split into clusters of this many blocks
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+static const int32_t MAGIC_NUMBER = 1337;
 
 enum TypeEnum
 {
@@ -14,6 +20,12 @@ enum TypeEnum
 
 typedef uint16_t Type;
 
+enum INodeFlags
+{
+    INODE_COMPRESSED = 1,
+    INODE_DEDUPLICATED = 2
+};
+
 #pragma pack(push, 1)
 
 struct INode
@@ -21,6 +33,7 @@ struct INode
     Type type;
     uint32_t size;
     uint16_t linkCounter;
+    uint16_t flags;
     // TODO(nmakeenkov): Also add indirect blocks
     uint16_t blocks[BLOCKS_COUNT];
 };
@@ -39,3 +52,6 @@ struct SuperBlock
 };
 
 #pragma pack(pop)
+
+// I-nodes are stored in the single block following the super block
+#define INODES_COUNT (BLOCK_SIZE / sizeof(struct INode))